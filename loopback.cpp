@@ -0,0 +1,518 @@
+//
+// In-process loopback transport for the SocketAPI abstraction.
+//
+
+#include "loopback.h"
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+#ifdef LOGURU_SUPPORT
+#define LOGURU_WITH_STREAMS 1
+
+#include <loguru/loguru.hpp>
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <thread>
+
+namespace socketscpp
+{
+    SPSCRing::SPSCRing(size_t capacity)
+    : mask([capacity]()
+           {
+               size_t size = 1;
+               while (size < capacity) size <<= 1;
+               return size - 1;
+           }()),
+      head(0), tail(0)
+    {
+        buf.reset(new char[mask + 1]);
+    }
+
+    size_t SPSCRing::write(const char* data, size_t len)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        size_t n = std::min(len, (mask + 1) - (t - h));
+        if (0 == n) return 0;
+
+        // copy in at most two pieces, wrapping around the end of the buffer
+        size_t offset = t & mask;
+        size_t first = std::min(n, (mask + 1) - offset);
+        memcpy(buf.get() + offset, data, first);
+        memcpy(buf.get(), data + first, n - first);
+
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    size_t SPSCRing::read(char* data, size_t len)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t n = std::min(len, t - h);
+        if (0 == n) return 0;
+
+        size_t offset = h & mask;
+        size_t first = std::min(n, (mask + 1) - offset);
+        memcpy(data, buf.get() + offset, first);
+        memcpy(data + first, buf.get(), n - first);
+
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    size_t SPSCRing::available() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    size_t SPSCRing::space() const
+    {
+        return (mask + 1) - available();
+    }
+
+    /*
+     * Both ends of a simulated connection. Side 0 is the client end, side 1 the server end;
+     * each side only ever writes to one ring and reads from the other, and only draws from
+     * its own random generator, so fault sequences are reproducible per connection.
+     */
+    struct LoopbackTransport::Channel
+    {
+        SPSCRing to_server;
+        SPSCRing to_client;
+
+        std::atomic<bool> closed[2];
+        std::atomic<bool> shut[2];
+        std::atomic<bool> reset;
+        std::atomic<int> refs;
+
+        std::mt19937 rng[2];
+
+        Channel(size_t capacity, uint32_t seed, size_t id)
+        : to_server(capacity), to_client(capacity), reset(false), refs(2)
+        {
+            closed[0] = false;
+            closed[1] = false;
+            shut[0] = false;
+            shut[1] = false;
+            rng[0].seed(seed + 2 * id);
+            rng[1].seed(seed + 2 * id + 1);
+        }
+
+        SPSCRing& outbound(int side)
+        { return 0 == side ? to_server : to_client; }
+
+        SPSCRing& inbound(int side)
+        { return 0 == side ? to_client : to_server; }
+
+        bool peerGone(int side)
+        { return closed[side ^ 1].load() || shut[side ^ 1].load(); }
+    };
+
+    static inline bool roll(std::mt19937& rng, double probability)
+    {
+        return probability > 0 && std::uniform_real_distribution<double>(0.0, 1.0)(rng) < probability;
+    }
+
+    static inline void backoff(unsigned& spins)
+    {
+        // blocking calls spin briefly before starting to sleep, to keep the CPU cost honest
+        if (++spins < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    LoopbackTransport::LoopbackTransport(LoopbackFaults faults, size_t max_connections, size_t ring_capacity)
+    : ring_capacity(ring_capacity), faults(faults), channels(max_connections), next_channel(0),
+      bytes_sent(0), send_calls(0), recv_calls(0), faults_injected(0)
+    {
+#ifdef LOGURU_SUPPORT
+        CHECK_LE_S(max_connections, (size_t) (INT32_MAX - FD_BASE) / 2) << "Too many simulated connections.";
+#else
+        if (max_connections > (size_t) (INT32_MAX - FD_BASE) / 2)
+        {
+            std::cerr << "Too many simulated connections." << std::endl;
+            exit(-1);
+        }
+#endif
+    }
+
+    LoopbackTransport::~LoopbackTransport() = default;
+
+    LoopbackTransport::Channel* LoopbackTransport::lookup(int fd) const
+    {
+        if (fd < FD_BASE) return nullptr;
+        auto slot = (size_t) (fd - FD_BASE) >> 1;
+        if (slot >= channels.size()) return nullptr;
+        return channels[slot].get();
+    }
+
+    Connection LoopbackTransport::Connect()
+    {
+        size_t slot = next_channel.fetch_add(1);
+#ifdef LOGURU_SUPPORT
+        CHECK_LT_S(slot, channels.size()) << "Loopback transport ran out of connections.";
+#else
+        if (slot >= channels.size())
+        {
+            std::cerr << "Loopback transport ran out of connections." << std::endl;
+            exit(-1);
+        }
+#endif
+        channels[slot].reset(new Channel(ring_capacity, faults.seed, slot));
+
+        int client_fd = FD_BASE + (int) slot * 2;
+        {
+            std::lock_guard<std::mutex> guard(backlog_lock);
+            backlog.push_back(client_fd + 1);
+        }
+        backlog_cv.notify_one();
+
+        auto* _addr = (sockaddr_in*) calloc(1, sizeof(sockaddr_in));
+        _addr->sin_family = AF_INET;
+        _addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return Connection(client_fd, (sockaddr*) _addr, getSocketAPI());
+    }
+
+    int LoopbackTransport::accept(int, sockaddr* addr, socklen_t* len)
+    {
+        int fd;
+        {
+            std::unique_lock<std::mutex> guard(backlog_lock);
+            backlog_cv.wait(guard, [this]
+            { return !backlog.empty(); });
+            fd = backlog.front();
+            backlog.pop_front();
+        }
+
+        if (nullptr != addr && nullptr != len && *len >= sizeof(sockaddr_in))
+        {
+            auto* _addr = (sockaddr_in*) addr;
+            memset(_addr, 0, sizeof(sockaddr_in));
+            _addr->sin_family = AF_INET;
+            _addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            _addr->sin_port = htons((uint16_t) ((fd - FD_BASE) >> 1));
+            *len = sizeof(sockaddr_in);
+        }
+
+        return fd;
+    }
+
+    ssize_t LoopbackTransport::send(int fd, const void* buf, size_t len, int flags)
+    {
+        send_calls.fetch_add(1, std::memory_order_relaxed);
+
+        Channel* ch = lookup(fd);
+        if (nullptr == ch)
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        int side = (fd - FD_BASE) & 1;
+        std::mt19937& rng = ch->rng[side];
+
+        if (ch->reset.load())
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (ch->shut[side].load() || ch->peerGone(side))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        if (roll(rng, faults.reset))
+        {
+            faults_injected.fetch_add(1, std::memory_order_relaxed);
+            ch->reset = true;
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (roll(rng, faults.eagain))
+        {
+            faults_injected.fetch_add(1, std::memory_order_relaxed);
+            errno = EAGAIN;
+            return -1;
+        }
+        if (0 == len) return 0;
+
+        if (faults.max_delay > faults.min_delay)
+        {
+            std::uniform_int_distribution<int64_t> delay(faults.min_delay.count(), faults.max_delay.count());
+            std::this_thread::sleep_for(std::chrono::microseconds(delay(rng)));
+        }
+        else if (faults.min_delay.count() > 0)
+            std::this_thread::sleep_for(faults.min_delay);
+
+        size_t want = len;
+        if (len > 1 && roll(rng, faults.partial_send))
+        {
+            faults_injected.fetch_add(1, std::memory_order_relaxed);
+            want = 1 + rng() % (len - 1);
+        }
+
+        SPSCRing& ring = ch->outbound(side);
+        size_t written;
+        unsigned spins = 0;
+        while (0 == (written = ring.write((const char*) buf, want)))
+        {
+            // ring full, block until the peer drains it
+            if (ch->reset.load())
+            {
+                errno = ECONNRESET;
+                return -1;
+            }
+            if (ch->shut[side].load() || ch->peerGone(side))
+            {
+                errno = EPIPE;
+                return -1;
+            }
+            if (flags & MSG_DONTWAIT)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            backoff(spins);
+        }
+
+        bytes_sent.fetch_add(written, std::memory_order_relaxed);
+        return written;
+    }
+
+    ssize_t LoopbackTransport::recv(int fd, void* buf, size_t len, int flags)
+    {
+        recv_calls.fetch_add(1, std::memory_order_relaxed);
+
+        Channel* ch = lookup(fd);
+        if (nullptr == ch)
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        int side = (fd - FD_BASE) & 1;
+        std::mt19937& rng = ch->rng[side];
+
+        if (ch->reset.load())
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (roll(rng, faults.reset))
+        {
+            faults_injected.fetch_add(1, std::memory_order_relaxed);
+            ch->reset = true;
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (roll(rng, faults.eagain))
+        {
+            faults_injected.fetch_add(1, std::memory_order_relaxed);
+            errno = EAGAIN;
+            return -1;
+        }
+        if (0 == len) return 0;
+
+        size_t want = len;
+        if (len > 1 && roll(rng, faults.short_read))
+        {
+            faults_injected.fetch_add(1, std::memory_order_relaxed);
+            want = 1 + rng() % (len - 1);
+        }
+
+        SPSCRing& ring = ch->inbound(side);
+        size_t received;
+        unsigned spins = 0;
+        while (0 == (received = ring.read((char*) buf, want)))
+        {
+            if (ch->reset.load())
+            {
+                errno = ECONNRESET;
+                return -1;
+            }
+            if (ch->shut[side].load())
+                return 0;
+            if (ch->peerGone(side))
+                // the peer may have written right before closing, drain before reporting EOF
+                return ring.read((char*) buf, want);
+            if (flags & MSG_DONTWAIT)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            backoff(spins);
+        }
+
+        return received;
+    }
+
+    int LoopbackTransport::close(int fd)
+    {
+        Channel* ch = lookup(fd);
+        int side = (fd - FD_BASE) & 1;
+        if (nullptr == ch || ch->closed[side].exchange(true))
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        // last end to close releases the channel
+        if (1 == ch->refs.fetch_sub(1))
+            channels[(size_t) (fd - FD_BASE) >> 1].reset();
+        return 0;
+    }
+
+    int LoopbackTransport::shutdown(int fd, int)
+    {
+        // both directions are always shut down, which is all the library needs
+        Channel* ch = lookup(fd);
+        if (nullptr == ch)
+        {
+            errno = EBADF;
+            return -1;
+        }
+        ch->shut[(fd - FD_BASE) & 1] = true;
+        return 0;
+    }
+
+    int LoopbackTransport::poll(pollfd* fds, nfds_t nfds, int timeout)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        unsigned spins = 0;
+        for (;;)
+        {
+            int ready = 0;
+            for (nfds_t i = 0; i < nfds; ++i)
+            {
+                fds[i].revents = 0;
+                Channel* ch = lookup(fds[i].fd);
+                if (nullptr == ch)
+                    fds[i].revents = POLLNVAL;
+                else
+                {
+                    int side = (fds[i].fd - FD_BASE) & 1;
+                    // a reset or shut down connection is reported ready, so that the next call fails
+                    bool gone = ch->reset.load() || ch->shut[side].load();
+                    if ((fds[i].events & POLLIN) && (gone || ch->peerGone(side) || ch->inbound(side).available() > 0))
+                        fds[i].revents |= POLLIN;
+                    if ((fds[i].events & POLLOUT) && (gone || ch->peerGone(side) || ch->outbound(side).space() > 0))
+                        fds[i].revents |= POLLOUT;
+                }
+                if (0 != fds[i].revents) ++ready;
+            }
+
+            if (ready > 0 || 0 == timeout) return ready;
+            if (timeout > 0 && std::chrono::steady_clock::now() >= deadline) return 0;
+            backoff(spins);
+        }
+    }
+
+    SocketAPI LoopbackTransport::getSocketAPI()
+    {
+        SocketAPI api;
+        api.error_code = -1;
+
+        // listening is implicit; client ends are opened through LoopbackTransport::Connect()
+        api.bind = [](int, const sockaddr*, socklen_t)
+        { return 0; };
+        api.listen = [](int, int)
+        { return 0; };
+        api.connect = [](int, const sockaddr*, socklen_t)
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        };
+
+        api.accept = [this](int fd, sockaddr* addr, socklen_t* len)
+        { return accept(fd, addr, len); };
+        api.send = [this](int fd, const void* buf, size_t len, int flags)
+        { return send(fd, buf, len, flags); };
+        api.recv = [this](int fd, void* buf, size_t len, int flags)
+        { return recv(fd, buf, len, flags); };
+        api.close = [this](int fd)
+        { return close(fd); };
+        api.shutdown = [this](int fd, int how)
+        { return shutdown(fd, how); };
+        api.poll = [this](pollfd* fds, nfds_t nfds, int timeout)
+        { return poll(fds, nfds, timeout); };
+
+        return api;
+    }
+
+    static std::chrono::duration<double> processCPUTime()
+    {
+        timespec ts{};
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+    }
+
+    LoadGenerator::LoadGenerator(LoopbackTransport& transport, TCPServerSocket& server, size_t threads)
+    : transport(transport), server(server), threads(std::max<size_t>(threads, 1))
+    {
+        server.setSocketAPI(transport.getSocketAPI());
+        server.BindAndListen();
+    }
+
+    LoadReport LoadGenerator::run(size_t clients,
+                                  const std::function<void(Connection&, size_t)>& client,
+                                  const std::function<void(Connection&)>& handler)
+    {
+        std::atomic<size_t> next_client(0);
+        std::atomic<size_t> next_accept(0);
+
+        uint64_t bytes = transport.bytesSent();
+        uint64_t send_calls = transport.sendCalls();
+        uint64_t recv_calls = transport.recvCalls();
+        auto cpu_start = processCPUTime();
+        auto wall_start = std::chrono::steady_clock::now();
+
+        /*
+         * Server workers take connections off the backlog in the order clients open them,
+         * and there are as many server workers as client workers, so every client in flight
+         * is eventually picked up regardless of what the scripts do.
+         */
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+        {
+            workers.emplace_back([&]()
+                                 {
+                                     while (next_accept.fetch_add(1) < clients)
+                                     {
+                                         Connection conn = server.AcceptConnection();
+                                         handler(conn);
+                                     }
+                                 });
+            workers.emplace_back([&]()
+                                 {
+                                     size_t id;
+                                     while ((id = next_client.fetch_add(1)) < clients)
+                                     {
+                                         Connection conn = transport.Connect();
+                                         client(conn, id);
+                                     }
+                                 });
+        }
+        for (auto& worker : workers)
+            worker.join();
+
+        LoadReport report{};
+        report.clients = clients;
+        report.bytes = transport.bytesSent() - bytes;
+        report.send_calls = transport.sendCalls() - send_calls;
+        report.recv_calls = transport.recvCalls() - recv_calls;
+        report.wall_time = std::chrono::steady_clock::now() - wall_start;
+        report.cpu_time = processCPUTime() - cpu_start;
+        return report;
+    }
+}
+
+#pragma clang diagnostic pop
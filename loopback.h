@@ -0,0 +1,191 @@
+//
+// In-process loopback transport for the SocketAPI abstraction.
+//
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+#ifndef SOCKETSCPP_LOOPBACK_H
+#define SOCKETSCPP_LOOPBACK_H
+
+#include "sockets.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <random>
+
+namespace socketscpp
+{
+/**
+ * @brief Fault and latency injection settings for a LoopbackTransport.
+ * Probabilities are evaluated independently on every send/recv call.
+ */
+    struct LoopbackFaults
+    {
+        double partial_send = 0.0; // send accepts only part of the buffer
+        double short_read = 0.0;   // recv returns fewer bytes than available
+        double eagain = 0.0;       // call fails with EAGAIN without transferring data
+        double reset = 0.0;        // connection is reset, both ends get ECONNRESET
+
+        // delay applied to every send, uniformly drawn from [min_delay, max_delay]
+        std::chrono::microseconds min_delay{0};
+        std::chrono::microseconds max_delay{0};
+
+        // seed for the per-endpoint generators, making fault sequences reproducible
+        uint32_t seed = 0;
+    };
+
+/**
+ * @brief Single producer, single consumer lock-free byte ring buffer.
+ */
+    class SPSCRing
+    {
+    private:
+        std::unique_ptr<char[]> buf;
+        const size_t mask;
+
+        /*
+         * Explicit padding rather than alignas: rings are heap allocated and C++14 operator new
+         * does not honour over-alignment, but padding keeps the indices a cache line apart anyway.
+         */
+        char pad0[64];
+        std::atomic<size_t> head; // next byte to read, owned by the consumer
+        char pad1[64];
+        std::atomic<size_t> tail; // next byte to write, owned by the producer
+        char pad2[64];
+
+    public:
+        /**
+         * @param capacity Size of the buffer in bytes, rounded up to a power of two.
+         */
+        explicit SPSCRing(size_t capacity);
+
+        size_t write(const char* data, size_t len);
+        size_t read(char* data, size_t len);
+        size_t available() const;
+        size_t space() const;
+    };
+
+/**
+ * @brief In-memory transport implementing SocketAPI without touching the kernel.
+ *
+ * Each simulated connection is a pair of SPSCRing buffers, one per direction, with
+ * blocking semantics matching those of a blocking stream socket; MSG_DONTWAIT makes a
+ * single call non-blocking, and poll() waits on the buffers. Connections are opened
+ * with Connect(), and their server ends are handed out by the accept() operation of
+ * getSocketAPI(), so that it can be injected into a TCPServerSocket or UnixSocket.
+ * Simulated file descriptors live far above the range handed out by the kernel.
+ */
+    class LoopbackTransport
+    {
+    private:
+        struct Channel;
+
+        const size_t ring_capacity;
+        const LoopbackFaults faults;
+
+        std::vector<std::unique_ptr<Channel>> channels;
+        std::atomic<size_t> next_channel;
+
+        std::mutex backlog_lock;
+        std::condition_variable backlog_cv;
+        std::deque<int> backlog;
+
+        std::atomic<uint64_t> bytes_sent;
+        std::atomic<uint64_t> send_calls;
+        std::atomic<uint64_t> recv_calls;
+        std::atomic<uint64_t> faults_injected;
+
+        Channel* lookup(int fd) const;
+
+        int accept(int fd, sockaddr* addr, socklen_t* len);
+        ssize_t send(int fd, const void* buf, size_t len, int flags);
+        ssize_t recv(int fd, void* buf, size_t len, int flags);
+        int close(int fd);
+        int shutdown(int fd, int how);
+        int poll(pollfd* fds, nfds_t nfds, int timeout);
+
+    public:
+        static const int FD_BASE = 1 << 24;
+
+        /**
+         * @param faults Faults and latency to inject into every connection.
+         * @param max_connections Total number of connections which can be opened over the
+         * lifetime of the transport.
+         * @param ring_capacity Buffer size in bytes for each direction of a connection.
+         */
+        explicit LoopbackTransport(LoopbackFaults faults = LoopbackFaults(),
+                                   size_t max_connections = 65536,
+                                   size_t ring_capacity = 16384);
+        ~LoopbackTransport();
+
+        /**
+         * @brief Opens a new simulated connection, queueing its server end to be accepted.
+         * @return The client end of the connection.
+         */
+        Connection Connect();
+
+        /**
+         * @return A SocketAPI operating on this transport, to be injected into sockets or connections.
+         */
+        SocketAPI getSocketAPI();
+
+        uint64_t bytesSent() const
+        { return bytes_sent.load(std::memory_order_relaxed); }
+
+        uint64_t sendCalls() const
+        { return send_calls.load(std::memory_order_relaxed); }
+
+        uint64_t recvCalls() const
+        { return recv_calls.load(std::memory_order_relaxed); }
+
+        uint64_t faultsInjected() const
+        { return faults_injected.load(std::memory_order_relaxed); }
+    };
+
+/**
+ * @brief Results of a LoadGenerator run.
+ */
+    struct LoadReport
+    {
+        size_t clients;
+        uint64_t bytes;
+        uint64_t send_calls;
+        uint64_t recv_calls;
+        std::chrono::duration<double> wall_time;
+        std::chrono::duration<double> cpu_time; // process CPU time, summed over all threads
+    };
+
+/**
+ * @brief Drives many simulated clients against server connection handling code over
+ * a LoopbackTransport, to measure the CPU cost of the library itself.
+ */
+    class LoadGenerator
+    {
+    private:
+        LoopbackTransport& transport;
+        TCPServerSocket& server;
+        const size_t threads;
+
+    public:
+        /**
+         * @brief Injects the transport into the server socket and starts listening on it.
+         * @param threads Number of client threads, and of server threads handling connections.
+         */
+        LoadGenerator(LoopbackTransport& transport, TCPServerSocket& server, size_t threads = 4);
+
+        /**
+         * @brief Runs the given number of clients to completion.
+         * @param clients Total number of client connections to simulate.
+         * @param client Client side script, receives the connection and the client index.
+         * @param handler Server side handler, invoked once per accepted connection.
+         */
+        LoadReport run(size_t clients,
+                       const std::function<void(Connection&, size_t)>& client,
+                       const std::function<void(Connection&)>& handler);
+    };
+}
+
+#endif //SOCKETSCPP_LOOPBACK_H
+
+#pragma clang diagnostic pop
@@ -0,0 +1,408 @@
+//
+// Compile-time wire encoding of user structs, see Connection::sendStruct().
+//
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+#ifndef SOCKETSCPP_SERIALIZATION_H
+#define SOCKETSCPP_SERIALIZATION_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// upper bound for the length prefix of variable-size struct messages
+#define MAX_STRUCT_MESSAGE_SIZE (64u * 1024u * 1024u)
+// fixed-size struct messages up to this size are encoded on the stack, larger ones on the heap
+#define MAX_STRUCT_STACK_BUFFER (16u * 1024u)
+
+/**
+ * @brief Describes the fields of a struct which are sent over the wire, in order.
+ * Place it inside the struct definition:
+ *
+ *     struct Sample
+ *     {
+ *         uint32_t id;
+ *         double value;
+ *         std::string name;
+ *         SOCKETSCPP_FIELDS(id, value, name)
+ *     };
+ *
+ * Supported field types are arithmetic types, enums, std::array, std::string, std::vector
+ * and other structs described with SOCKETSCPP_FIELDS.
+ */
+#define SOCKETSCPP_FIELDS(...) \
+    auto socketscpp_fields() { return std::tie(__VA_ARGS__); } \
+    auto socketscpp_fields() const { return std::tie(__VA_ARGS__); }
+
+namespace socketscpp
+{
+/*
+ * Wire format: fields are laid out back to back with no padding, in little endian order, so that
+ * on little endian hosts encoding and decoding are plain copies. Variable-size fields (strings and
+ * vectors) carry a uint32_t element count. Structs with only fixed-size fields have their encoded
+ * size and layout fully determined at compile time.
+ */
+    namespace wire
+    {
+        template<typename...>
+        struct make_void
+        { typedef void type; };
+
+        template<typename T, typename = void>
+        struct has_fields : std::false_type
+        {};
+
+        template<typename T>
+        struct has_fields<T, typename make_void<decltype(std::declval<const T&>().socketscpp_fields())>::type>
+        : std::true_type
+        {};
+
+        constexpr bool allOf()
+        { return true; }
+
+        template<typename... Rest>
+        constexpr bool allOf(bool first, Rest... rest)
+        { return first && allOf(rest...); }
+
+        constexpr size_t sum()
+        { return 0; }
+
+        template<typename... Rest>
+        constexpr size_t sum(size_t first, Rest... rest)
+        { return first + sum(rest...); }
+
+        constexpr bool hostIsLittleEndian()
+        { return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__; }
+
+        // in-place conversion between host and wire order, a no-op on little endian hosts
+        template<size_t N>
+        inline void swapBytes(char* p)
+        {
+            if (hostIsLittleEndian()) return;
+            for (size_t i = 0; i < N / 2; ++i)
+                std::swap(p[i], p[N - 1 - i]);
+        }
+
+        template<typename T, typename Enable = void>
+        struct Codec
+        {
+            static_assert(sizeof(T) == 0, "Type cannot be sent over the wire, describe it with SOCKETSCPP_FIELDS.");
+        };
+
+        template<typename T>
+        struct Codec<T, typename std::enable_if<(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value)
+                                                || std::is_enum<T>::value>::type>
+        {
+            static constexpr bool fixed = true;
+            static constexpr size_t size = sizeof(T);
+            static constexpr size_t min_size = size;
+
+            static size_t encodedSize(const T&)
+            { return size; }
+
+            static char* encode(const T& value, char* out)
+            {
+                memcpy(out, &value, size);
+                swapBytes<size>(out);
+                return out + size;
+            }
+
+            static const char* decode(T& value, const char* in, const char* end)
+            {
+                if (nullptr == in || (size_t) (end - in) < size) return nullptr;
+                char tmp[size];
+                memcpy(tmp, in, size);
+                swapBytes<size>(tmp);
+                memcpy(&value, tmp, size);
+                return in + size;
+            }
+        };
+
+        // scratch space for encoding or decoding a whole message of a size known at compile time
+        template<size_t N, bool = (N <= MAX_STRUCT_STACK_BUFFER)>
+        struct Buffer
+        {
+            char bytes[N > 0 ? N : 1];
+
+            char* data()
+            { return bytes; }
+        };
+
+        template<size_t N>
+        struct Buffer<N, false>
+        {
+            std::vector<char> bytes;
+
+            Buffer() : bytes(N)
+            {}
+
+            char* data()
+            { return bytes.data(); }
+        };
+
+        // booleans go out as a single byte, any nonzero byte received reads as true
+        template<>
+        struct Codec<bool>
+        {
+            static constexpr bool fixed = true;
+            static constexpr size_t size = 1;
+            static constexpr size_t min_size = size;
+
+            static size_t encodedSize(const bool&)
+            { return size; }
+
+            static char* encode(const bool& value, char* out)
+            {
+                *out = (char) (value ? 1 : 0);
+                return out + size;
+            }
+
+            static const char* decode(bool& value, const char* in, const char* end)
+            {
+                if (nullptr == in || end == in) return nullptr;
+                value = 0 != *in;
+                return in + size;
+            }
+        };
+
+        // element counts of variable-size fields
+        using Length = Codec<uint32_t>;
+
+        /*
+         * Sequences of elements; arithmetic elements are copied as one block when the host
+         * byte order matches the wire order.
+         */
+        template<typename E>
+        struct Elements
+        {
+            static constexpr bool block = hostIsLittleEndian() && std::is_arithmetic<E>::value
+                                          && !std::is_same<E, bool>::value;
+
+            static size_t encodedSize(const E* data, size_t n)
+            {
+                if (Codec<E>::fixed) return n * Codec<E>::size;
+                size_t total = 0;
+                for (size_t i = 0; i < n; ++i) total += Codec<E>::encodedSize(data[i]);
+                return total;
+            }
+
+            static char* encode(const E* data, size_t n, char* out)
+            {
+                if (block)
+                {
+                    memcpy(out, data, n * sizeof(E));
+                    return out + n * sizeof(E);
+                }
+                for (size_t i = 0; i < n; ++i) out = Codec<E>::encode(data[i], out);
+                return out;
+            }
+
+            static const char* decode(E* data, size_t n, const char* in, const char* end)
+            {
+                if (block)
+                {
+                    if (nullptr == in || (size_t) (end - in) / sizeof(E) < n) return nullptr;
+                    memcpy(static_cast<void*>(data), in, n * sizeof(E));
+                    return in + n * sizeof(E);
+                }
+                for (size_t i = 0; i < n && nullptr != in; ++i) in = Codec<E>::decode(data[i], in, end);
+                return in;
+            }
+        };
+
+        template<typename E, size_t N>
+        struct Codec<std::array<E, N>>
+        {
+            static constexpr bool fixed = Codec<E>::fixed;
+            static constexpr size_t size = N * Codec<E>::size;
+            static constexpr size_t min_size = N * Codec<E>::min_size;
+
+            static size_t encodedSize(const std::array<E, N>& value)
+            { return Elements<E>::encodedSize(value.data(), N); }
+
+            static char* encode(const std::array<E, N>& value, char* out)
+            { return Elements<E>::encode(value.data(), N, out); }
+
+            static const char* decode(std::array<E, N>& value, const char* in, const char* end)
+            { return Elements<E>::decode(value.data(), N, in, end); }
+        };
+
+        template<>
+        struct Codec<std::string>
+        {
+            static constexpr bool fixed = false;
+            static constexpr size_t size = 0;
+            static constexpr size_t min_size = Length::size;
+
+            static size_t encodedSize(const std::string& value)
+            { return Length::size + value.size(); }
+
+            static char* encode(const std::string& value, char* out)
+            {
+                out = Length::encode((uint32_t) value.size(), out);
+                memcpy(out, value.data(), value.size());
+                return out + value.size();
+            }
+
+            static const char* decode(std::string& value, const char* in, const char* end)
+            {
+                uint32_t n = 0;
+                in = Length::decode(n, in, end);
+                if (nullptr == in || (size_t) (end - in) < n) return nullptr;
+                value.assign(in, n);
+                return in + n;
+            }
+        };
+
+        /*
+         * Element counts read off the wire are checked against the smallest possible encoding
+         * of an element before anything is allocated, so that a short message cannot make the
+         * receiver allocate far more memory than the message itself takes.
+         */
+        template<typename E>
+        inline bool countFits(uint32_t n, const char* in, const char* end)
+        {
+            return nullptr != in && (size_t) (end - in) / (Codec<E>::min_size > 0 ? Codec<E>::min_size : 1) >= n;
+        }
+
+        template<typename E>
+        struct Codec<std::vector<E>>
+        {
+            static constexpr bool fixed = false;
+            static constexpr size_t size = 0;
+            static constexpr size_t min_size = Length::size;
+
+            static size_t encodedSize(const std::vector<E>& value)
+            { return Length::size + Elements<E>::encodedSize(value.data(), value.size()); }
+
+            static char* encode(const std::vector<E>& value, char* out)
+            {
+                out = Length::encode((uint32_t) value.size(), out);
+                return Elements<E>::encode(value.data(), value.size(), out);
+            }
+
+            static const char* decode(std::vector<E>& value, const char* in, const char* end)
+            {
+                uint32_t n = 0;
+                in = Length::decode(n, in, end);
+                if (!countFits<E>(n, in, end)) return nullptr;
+
+                if (Codec<E>::fixed)
+                {
+                    value.resize(n);
+                    return Elements<E>::decode(value.data(), n, in, end);
+                }
+
+                // variable-size elements may be much larger in memory than on the wire, grow as they decode
+                value.clear();
+                for (uint32_t i = 0; i < n && nullptr != in; ++i)
+                {
+                    value.emplace_back();
+                    in = Codec<E>::decode(value.back(), in, end);
+                }
+                return in;
+            }
+        };
+
+        // std::vector<bool> has no contiguous storage, its elements go out one byte each as with bool
+        template<>
+        struct Codec<std::vector<bool>>
+        {
+            static constexpr bool fixed = false;
+            static constexpr size_t size = 0;
+            static constexpr size_t min_size = Length::size;
+
+            static size_t encodedSize(const std::vector<bool>& value)
+            { return Length::size + value.size(); }
+
+            static char* encode(const std::vector<bool>& value, char* out)
+            {
+                out = Length::encode((uint32_t) value.size(), out);
+                for (bool element : value) out = Codec<bool>::encode(element, out);
+                return out;
+            }
+
+            static const char* decode(std::vector<bool>& value, const char* in, const char* end)
+            {
+                uint32_t n = 0;
+                in = Length::decode(n, in, end);
+                if (nullptr == in || (size_t) (end - in) < n) return nullptr;
+                value.resize(n);
+                for (uint32_t i = 0; i < n; ++i) value[i] = 0 != in[i];
+                return in + n;
+            }
+        };
+
+        template<typename T>
+        struct Codec<T, typename std::enable_if<has_fields<T>::value>::type>
+        {
+        private:
+            template<typename F>
+            using FieldCodec = Codec<typename std::decay<F>::type>;
+
+            template<typename Tuple>
+            struct Layout;
+
+            template<typename... F>
+            struct Layout<std::tuple<F...>>
+            {
+                static constexpr bool fixed = allOf(FieldCodec<F>::fixed...);
+                static constexpr size_t size = sum(FieldCodec<F>::size...);
+                static constexpr size_t min_size = sum(FieldCodec<F>::min_size...);
+            };
+
+            using Fields = decltype(std::declval<const T&>().socketscpp_fields());
+
+            template<typename Tuple, size_t... I>
+            static size_t encodedSize(const Tuple& fields, std::index_sequence<I...>)
+            {
+                return sum(FieldCodec<typename std::tuple_element<I, Tuple>::type>::encodedSize(std::get<I>(fields))...);
+            }
+
+            template<typename Tuple, size_t... I>
+            static char* encode(const Tuple& fields, char* out, std::index_sequence<I...>)
+            {
+                using expander = int[];
+                (void) expander{0, (out = FieldCodec<typename std::tuple_element<I, Tuple>::type>
+                ::encode(std::get<I>(fields), out), 0)...};
+                return out;
+            }
+
+            template<typename Tuple, size_t... I>
+            static const char* decode(const Tuple& fields, const char* in, const char* end, std::index_sequence<I...>)
+            {
+                using expander = int[];
+                (void) expander{0, (in = FieldCodec<typename std::tuple_element<I, Tuple>::type>
+                ::decode(std::get<I>(fields), in, end), 0)...};
+                return in;
+            }
+
+            using Indices = std::make_index_sequence<std::tuple_size<Fields>::value>;
+
+        public:
+            static constexpr bool fixed = Layout<Fields>::fixed;
+            static constexpr size_t size = Layout<Fields>::size;
+            static constexpr size_t min_size = Layout<Fields>::min_size;
+
+            static size_t encodedSize(const T& value)
+            { return fixed ? size : encodedSize(value.socketscpp_fields(), Indices()); }
+
+            static char* encode(const T& value, char* out)
+            { return encode(value.socketscpp_fields(), out, Indices()); }
+
+            static const char* decode(T& value, const char* in, const char* end)
+            { return decode(value.socketscpp_fields(), in, end, Indices()); }
+        };
+    }
+}
+
+#endif //SOCKETSCPP_SERIALIZATION_H
+
+#pragma clang diagnostic pop
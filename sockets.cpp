@@ -21,6 +21,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <iostream>
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 
 namespace socketscpp
 {
@@ -34,7 +40,7 @@ namespace socketscpp
         if (-1 == socket_fd) exit(errno);
 #endif
 
-        auto* _addr = new sockaddr_un{};
+        auto* _addr = (sockaddr_un*) calloc(1, sizeof(sockaddr_un));
         _addr->sun_family = AF_UNIX;
         strncpy(_addr->sun_path, socket_path.c_str(), sizeof(_addr->sun_path) - 1);
 #pragma clang diagnostic push
@@ -49,6 +55,9 @@ namespace socketscpp
 
         socketAPI.send = send;
         socketAPI.recv = recv;
+        socketAPI.close = close;
+        socketAPI.shutdown = shutdown;
+        socketAPI.poll = poll;
 
         socketAPI.error_code = -1;
     }
@@ -71,14 +80,14 @@ namespace socketscpp
 
         /*
          * We need to copy the socket address to a new structure to pass to the connection since the destructor
-         * of the connection deletes its address - and we don't want to end up with a dangling pointer here,
+         * of the connection frees its address - and we don't want to end up with a dangling pointer here,
          * do we now?
          */
         auto _addr = ISocket::getAddr();
-        auto n_addr = (sockaddr*) malloc(sizeof(sockaddr));
-        memcpy(n_addr, _addr, sizeof(sockaddr));
+        auto n_addr = (sockaddr*) calloc(1, sizeof(sockaddr_un));
+        memcpy(n_addr, _addr, sizeof(sockaddr_un));
 
-        return Connection(socket_fd, n_addr, socketAPI);
+        return Connection(socket_fd, n_addr, socketAPI, wheel, timeouts);
     }
 
     void UnixSocket::BindAndListen()
@@ -99,7 +108,7 @@ namespace socketscpp
 
     Connection UnixSocket::AcceptConnection()
     {
-        auto* peer_addr = (sockaddr*) (new sockaddr_un{});
+        auto* peer_addr = (sockaddr*) calloc(1, sizeof(sockaddr_un));
         socklen_t len = sizeof(sockaddr_un);
         int connection_fd = socketAPI.accept(socket_fd, peer_addr, &len);
 #ifdef LOGURU_SUPPORT
@@ -110,14 +119,360 @@ namespace socketscpp
         if (connection_fd == socketAPI.error_code) exit(errno);
 #endif
 
-        return Connection(connection_fd, peer_addr, socketAPI);
+        return Connection(connection_fd, peer_addr, socketAPI, wheel, timeouts);
     }
 
+    void UnixSocket::setTimeouts(const ConnectionTimeouts& timeouts, std::shared_ptr<TimerWheel> wheel)
+    {
+        if (!wheel) wheel = std::make_shared<TimerWheel>();
+        wheel->start();
+        this->wheel = std::move(wheel);
+        this->timeouts = timeouts;
+    }
+
+
+    /*
+     * Errors on which a send/recv loop should try again, and errors which mean the peer
+     * is gone and should be handled like an orderly shutdown. A descriptor which turned out
+     * to be non-blocking is waited on through the connection's SocketAPI before retrying,
+     * rather than spun on.
+     */
+    static inline bool retryable(const SocketAPI& api, int fd, int err, bool write)
+    {
+        if (EINTR == err) return true;
+        if (EAGAIN != err && EWOULDBLOCK != err) return false;
+
+        pollfd pfd{fd, (short) (write ? POLLOUT : POLLIN), 0};
+        int ready;
+        do
+            ready = api.poll ? api.poll(&pfd, 1, -1) : poll(&pfd, 1, -1);
+        while (-1 == ready && EINTR == errno);
+        return true;
+    }
+
+    static inline bool peerReset(int err)
+    {
+        return ECONNRESET == err || EPIPE == err;
+    }
+
+    TimerWheel::TimerWheel(std::chrono::milliseconds tick)
+    : tick(std::max(std::chrono::duration_cast<Clock::duration>(tick), Clock::duration(1))),
+      origin(Clock::now()), current(0), slots(), running(false)
+    {}
+
+    TimerWheel::~TimerWheel()
+    {
+        stop();
+    }
+
+    void TimerWheel::link(Timer& timer)
+    {
+        // timers past the range of the top level are clamped to its far end
+        const uint64_t range = (uint64_t) 1 << (LEVEL_BITS * LEVELS);
+        if (timer.expiry - current >= range)
+            timer.expiry = current + range - 1;
+
+        uint64_t delta = timer.expiry - current;
+        unsigned level = 0;
+        while (delta >= ((uint64_t) 1 << (LEVEL_BITS * (level + 1))))
+            ++level;
+
+        Timer** slot = &slots[level][(timer.expiry >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+        timer.slot = slot;
+        timer.prev = nullptr;
+        timer.next = *slot;
+        if (nullptr != *slot) (*slot)->prev = &timer;
+        *slot = &timer;
+    }
+
+    void TimerWheel::unlink(Timer& timer)
+    {
+        if (nullptr != timer.prev)
+            timer.prev->next = timer.next;
+        else
+            *timer.slot = timer.next;
+        if (nullptr != timer.next) timer.next->prev = timer.prev;
+
+        timer.prev = nullptr;
+        timer.next = nullptr;
+        timer.slot = nullptr;
+    }
+
+    void TimerWheel::cascade(unsigned level)
+    {
+        // move the timers of the slot coming due on this level down, closer to their expiry
+        Timer** slot = &slots[level][(current >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+        Timer* timer = *slot;
+        *slot = nullptr;
+        while (nullptr != timer)
+        {
+            Timer* next = timer->next;
+            link(*timer);
+            timer = next;
+        }
+    }
+
+    void TimerWheel::schedule(Timer& timer, std::chrono::milliseconds delay)
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        if (nullptr != timer.slot) unlink(timer);
+
+        auto ticks = (uint64_t) ((std::chrono::duration_cast<Clock::duration>(delay) + tick - Clock::duration(1)) / tick);
+        timer.expiry = current + std::max<uint64_t>(ticks, 1);
+        link(timer);
+    }
+
+    void TimerWheel::cancel(Timer& timer)
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        if (nullptr != timer.slot) unlink(timer);
+    }
+
+    bool TimerWheel::isArmed(const Timer& timer) const
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        return nullptr != timer.slot;
+    }
+
+    size_t TimerWheel::advance(Clock::time_point now)
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        if (now < origin) return 0;
+
+        auto target = (uint64_t) ((now - origin) / tick);
+        size_t fired = 0;
+        while (current < target)
+        {
+            ++current;
+
+            // cascade every level whose lower levels just wrapped around, topmost first
+            unsigned level = 1;
+            while (level < LEVELS && 0 == (current & (((uint64_t) 1 << (LEVEL_BITS * level)) - 1)))
+                ++level;
+            while (--level > 0)
+                cascade(level);
+
+            Timer** slot = &slots[0][current & (SLOTS - 1)];
+            while (nullptr != *slot)
+            {
+                Timer* timer = *slot;
+                unlink(*timer);
+                if (timer->callback) timer->callback();
+                ++fired;
+            }
+        }
+        return fired;
+    }
+
+    void TimerWheel::start()
+    {
+        std::lock_guard<std::mutex> guard(driver_lock);
+        if (running) return;
+        running = true;
+        driver = std::thread([this]()
+                             {
+                                 std::unique_lock<std::mutex> driver_guard(driver_lock);
+                                 while (running)
+                                 {
+                                     driver_cv.wait_for(driver_guard, tick);
+                                     if (!running) break;
+                                     driver_guard.unlock();
+                                     advance(Clock::now());
+                                     driver_guard.lock();
+                                 }
+                             });
+    }
+
+    void TimerWheel::stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(driver_lock);
+            if (!running) return;
+            running = false;
+        }
+        driver_cv.notify_all();
+        driver.join();
+    }
+
+    /*
+     * Timeout state of a connection. It lives on the heap, apart from the Connection object
+     * itself, so that timer callbacks never refer to a Connection which has been copied around.
+     * Timers are armed once and never touched by transfers, which keeps the wheel lock off the
+     * I/O path: transfers only record when they started and when data last moved, and a timer
+     * which fires early re-arms itself for the remainder.
+     */
+    struct ConnectionTimers
+    {
+        using Clock = TimerWheel::Clock;
+
+        const std::shared_ptr<TimerWheel> wheel;
+        const ConnectionTimeouts timeouts;
+        const int fd;
+        const std::function<int(int, int)> shutdown_fn;
+
+        std::atomic<Clock::rep> last_activity;
+        std::atomic<Clock::rep> read_started;  // 0 while no receive is in progress
+        std::atomic<Clock::rep> write_started; // 0 while no send is in progress
+        std::atomic<bool> closed;
+        std::atomic<bool> expired;
+        std::atomic<bool> heartbeat_due;
+
+        TimerWheel::Timer idle;
+        TimerWheel::Timer read_deadline;
+        TimerWheel::Timer write_deadline;
+        TimerWheel::Timer heartbeat;
+
+        ConnectionTimers(std::shared_ptr<TimerWheel> wheel, const ConnectionTimeouts& timeouts,
+                         int fd, std::function<int(int, int)> shutdown_fn)
+        : wheel(std::move(wheel)), timeouts(timeouts), fd(fd), shutdown_fn(std::move(shutdown_fn)),
+          last_activity(0), read_started(0), write_started(0), closed(false), expired(false), heartbeat_due(false)
+        {
+            touch();
+
+            idle.callback = [this]()
+            { check(idle, this->timeouts.idle, last_activity.load()); };
+            read_deadline.callback = [this]()
+            { check(read_deadline, this->timeouts.read, read_started.load()); };
+            write_deadline.callback = [this]()
+            { check(write_deadline, this->timeouts.write, write_started.load()); };
+            heartbeat.callback = [this]()
+            {
+                heartbeat_due = true;
+                this->wheel->schedule(heartbeat, this->timeouts.heartbeat);
+            };
+
+            if (timeouts.idle.count() > 0) this->wheel->schedule(idle, timeouts.idle);
+            if (timeouts.read.count() > 0) this->wheel->schedule(read_deadline, timeouts.read);
+            if (timeouts.write.count() > 0) this->wheel->schedule(write_deadline, timeouts.write);
+            if (timeouts.heartbeat.count() > 0) this->wheel->schedule(heartbeat, timeouts.heartbeat);
+        }
+
+        ~ConnectionTimers()
+        { disarm(); }
+
+        static Clock::rep now()
+        { return Clock::now().time_since_epoch().count(); }
+
+        void touch()
+        {
+            last_activity.store(now(), std::memory_order_relaxed);
+        }
+
+        /*
+         * Expires the connection if the given time has passed since the given instant, otherwise
+         * re-arms the timer for the remainder. An instant of 0 means there is nothing to measure,
+         * e.g. no transfer in progress, and the timer checks again a full period later.
+         */
+        void check(TimerWheel::Timer& timer, std::chrono::milliseconds timeout, Clock::rep since)
+        {
+            auto elapsed = Clock::duration(0 == since ? 0 : now() - since);
+            if (elapsed >= timeout)
+                expire();
+            else
+                wheel->schedule(timer, std::chrono::duration_cast<std::chrono::milliseconds>(timeout - elapsed)
+                                       + std::chrono::milliseconds(0 == since ? 0 : 1));
+        }
+
+        void disarm()
+        {
+            wheel->cancel(idle);
+            wheel->cancel(read_deadline);
+            wheel->cancel(write_deadline);
+            wheel->cancel(heartbeat);
+        }
+
+        // runs on the wheel's driver thread, with the wheel locked
+        void expire()
+        {
+            if (closed || expired.exchange(true)) return;
+            disarm();
+            if (shutdown_fn)
+                shutdown_fn(fd, SHUT_RDWR);
+            else
+                shutdown(fd, SHUT_RDWR);
+        }
+
+        /*
+         * Called right before the connection closes its descriptor. Cancelling takes the wheel lock,
+         * so once this returns no callback can shut down a descriptor number which may get reused.
+         */
+        void release()
+        {
+            closed = true;
+            disarm();
+        }
+    };
+
+    // blocking sends only return once everything is queued, so timed ones are split up
+    static const size_t TIMED_SEND_CHUNK = 64 * 1024;
+
+    /*
+     * Records the start of a transfer for the read or write deadline of a connection, which
+     * is checked by its timer. Every chunk moved through the socket counts as activity, so
+     * that a long transfer which keeps making progress is not reaped as idle.
+     */
+    class TransferGuard
+    {
+    private:
+        ConnectionTimers* timers;
+        std::atomic<ConnectionTimers::Clock::rep>* started;
+
+    public:
+        TransferGuard(ConnectionTimers* timers, bool write)
+        : timers(timers), started(nullptr)
+        {
+            if (nullptr == timers) return;
+            auto timeout = write ? timers->timeouts.write : timers->timeouts.read;
+            if (timeout.count() > 0)
+            {
+                started = write ? &timers->write_started : &timers->read_started;
+                started->store(ConnectionTimers::now(), std::memory_order_relaxed);
+            }
+        }
+
+        ~TransferGuard()
+        {
+            if (nullptr != started) started->store(0, std::memory_order_relaxed);
+        }
+
+        void progress()
+        {
+            if (nullptr != timers) timers->touch();
+        }
+
+        size_t chunk(size_t remaining) const
+        {
+            return nullptr != timers ? std::min(remaining, TIMED_SEND_CHUNK) : remaining;
+        }
+    };
+
+    Connection::Connection(const int fd, sockaddr* addr, SocketAPI api,
+                           std::shared_ptr<TimerWheel> wheel, const ConnectionTimeouts& timeouts)
+    : Connection(fd, addr, std::move(api))
+    {
+        if (wheel) setTimeouts(std::move(wheel), timeouts);
+    }
+
+    void Connection::setTimeouts(std::shared_ptr<TimerWheel> wheel, const ConnectionTimeouts& timeouts)
+    {
+        if (!open) return;
+        timers = std::make_shared<ConnectionTimers>(std::move(wheel), timeouts, fd, socketAPI.shutdown);
+    }
+
+    bool Connection::isExpired() const
+    {
+        return timers && timers->expired;
+    }
+
+    bool Connection::heartbeatDue()
+    {
+        return timers && timers->heartbeat_due.exchange(false);
+    }
 
     Connection::~Connection()
     {
         this->Close();
-        delete addr;
+        free(addr);
     }
 
 
@@ -131,6 +486,13 @@ namespace socketscpp
 #endif
             return 0;
         }
+        if (timers && timers->expired)
+        {
+            // reaped by its timers, the socket is already shut down
+            this->Close();
+            return 0;
+        }
+        TransferGuard guard(timers.get(), true);
 
         PrimType data;
         uint32_t total_sent = 0;
@@ -154,7 +516,9 @@ namespace socketscpp
 
         while (total_sent < sizeof(PrimType))
         {
-            sent = socketAPI.send(fd, ((const char*) &data) + total_sent, sizeof(PrimType) - total_sent, 0);
+            sent = socketAPI.send(fd, ((const char*) &data) + total_sent, sizeof(PrimType) - total_sent, MSG_NOSIGNAL);
+            if (-1 == sent && retryable(socketAPI, fd, errno, true)) continue;
+            if (-1 == sent && peerReset(errno)) sent = 0;
 #ifdef LOGURU_SUPPORT
             CHECK_NE_S(sent, -1) << "Error when trying to send primitive type, errno: " << strerror(errno);
 #else
@@ -171,6 +535,7 @@ namespace socketscpp
             }
 
             total_sent += sent;
+            guard.progress();
         }
 
         return total_sent;
@@ -186,6 +551,12 @@ namespace socketscpp
 #endif
             return 0;
         }
+        if (timers && timers->expired)
+        {
+            this->Close();
+            return 0;
+        }
+        TransferGuard guard(timers.get(), false);
 
         uint32_t total_received = 0;
         ssize_t received;
@@ -194,6 +565,8 @@ namespace socketscpp
         while (total_received < sizeof(PrimType))
         {
             received = socketAPI.recv(fd, ((char*) &data) + total_received, sizeof(PrimType) - total_received, 0);
+            if (-1 == received && retryable(socketAPI, fd, errno, false)) continue;
+            if (-1 == received && peerReset(errno)) received = 0;
 #ifdef LOGURU_SUPPORT
             CHECK_NE_S(received, -1) << "Error when trying to receive primitive type, errno: " << strerror(errno);
 #else
@@ -210,6 +583,7 @@ namespace socketscpp
             }
 
             total_received += received;
+            guard.progress();
         }
 
         size_t len = sizeof(PrimType);
@@ -267,12 +641,20 @@ namespace socketscpp
 #endif
             return 0;
         }
+        if (timers && timers->expired)
+        {
+            this->Close();
+            return 0;
+        }
+        TransferGuard guard(timers.get(), true);
 
         size_t total_sent = 0;
         ssize_t sent;
         while (total_sent < len)
         {
-            sent = socketAPI.send(fd, buf + total_sent, len - total_sent, 0);
+            sent = socketAPI.send(fd, buf + total_sent, guard.chunk(len - total_sent), MSG_NOSIGNAL);
+            if (-1 == sent && retryable(socketAPI, fd, errno, true)) continue;
+            if (-1 == sent && peerReset(errno)) sent = 0;
 #ifdef LOGURU_SUPPORT
             CHECK_NE_S(sent, -1) << "Error when trying to send buffer, errno : " << strerror(errno);
 #else
@@ -289,6 +671,7 @@ namespace socketscpp
             }
 
             total_sent += sent;
+            guard.progress();
         }
 
         return total_sent;
@@ -303,12 +686,20 @@ namespace socketscpp
 #endif
             return 0;
         }
+        if (timers && timers->expired)
+        {
+            this->Close();
+            return 0;
+        }
+        TransferGuard guard(timers.get(), false);
 
         size_t total_rcvd = 0;
         ssize_t rcvd;
         while (total_rcvd < len)
         {
             rcvd = socketAPI.recv(fd, buf + total_rcvd, len - total_rcvd, 0);
+            if (-1 == rcvd && retryable(socketAPI, fd, errno, false)) continue;
+            if (-1 == rcvd && peerReset(errno)) rcvd = 0;
 #ifdef LOGURU_SUPPORT
             CHECK_NE_S(rcvd, -1) << "Error when trying to send buffer, errno : " << strerror(errno);
 #else
@@ -325,11 +716,48 @@ namespace socketscpp
             }
 
             total_rcvd += rcvd;
+            guard.progress();
         }
 
         return total_rcvd;
     }
 
+    ssize_t Connection::trySend(const char* buf, size_t len)
+    {
+        if (!open) return -1;
+        if (timers && timers->expired)
+        {
+            this->Close();
+            return -1;
+        }
+
+        TransferGuard guard(timers.get(), true);
+        ssize_t sent;
+        do
+            sent = socketAPI.send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        while (-1 == sent && EINTR == errno);
+
+        if (-1 == sent && (EAGAIN == errno || EWOULDBLOCK == errno)) return 0;
+        if (-1 == sent && peerReset(errno)) sent = 0;
+#ifdef LOGURU_SUPPORT
+        CHECK_NE_S(sent, -1) << "Error when trying to send buffer, errno : " << strerror(errno);
+#else
+        if (-1 == sent) exit(errno);
+#endif
+
+        if (0 == sent && len > 0)
+        {
+#ifdef LOGURU_SUPPORT
+            LOG_S(INFO) << "Peer closed connection. Closing on this end.";
+#endif
+            this->Close();
+            return -1;
+        }
+
+        if (sent > 0) guard.progress();
+        return sent;
+    }
+
 #ifdef PROTOBUF_SUPPORT
 
     void Connection::sendMessage(const google::protobuf::Message& msg)
@@ -381,7 +809,11 @@ namespace socketscpp
     void Connection::Close()
     {
         if (!open) return;
-        close(fd);
+        if (timers) timers->release();
+        if (socketAPI.close)
+            socketAPI.close(fd);
+        else
+            close(fd);
         open = false;
     }
 
@@ -390,6 +822,258 @@ namespace socketscpp
         return open;
     }
 
+    EgressScheduler::EgressScheduler(size_t quantum, size_t high_watermark, size_t low_watermark)
+    : quantum(quantum), high_watermark(high_watermark), low_watermark(low_watermark)
+    {
+#ifdef LOGURU_SUPPORT
+        CHECK_GT_S(quantum, 0) << "Scheduler quantum must be greater than zero.";
+        CHECK_LE_S(low_watermark, high_watermark) << "Low watermark must not exceed the high watermark.";
+#else
+        if (0 == quantum || low_watermark > high_watermark)
+        {
+            std::cerr << "Invalid scheduler quantum or watermarks." << std::endl;
+            exit(-1);
+        }
+#endif
+    }
+
+    void EgressScheduler::addConnection(Connection& conn, uint32_t weight, uint64_t rate, uint64_t burst)
+    {
+#ifdef LOGURU_SUPPORT
+        CHECK_GT_S(weight, 0) << "Connection weight must be greater than zero.";
+#else
+        if (0 == weight)
+        {
+            std::cerr << "Connection weight must be greater than zero." << std::endl;
+            exit(-1);
+        }
+#endif
+        std::lock_guard<std::mutex> guard(lock);
+        Flow& flow = flows[&conn];
+        if (nullptr == flow.conn)
+        {
+            // new flow
+            flow.conn = &conn;
+            flow.generation = ++next_generation;
+            flow.deficit = 0;
+            flow.queued = 0;
+            flow.head_offset = 0;
+            flow.active = false;
+            flow.paused = false;
+        }
+
+        flow.weight = weight;
+        flow.rate = rate;
+        flow.burst = (0 == burst) ? (double) rate : (double) burst;
+        flow.tokens = flow.burst;
+        flow.last_refill = Clock::now();
+
+        if (flow.active)
+        {
+            // new rate limits apply from the next round
+            next_eligible = Clock::time_point();
+            work_cv.notify_all();
+        }
+    }
+
+    void EgressScheduler::removeConnection(Connection& conn)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        flows.erase(&conn);
+        // entries left in active_flows no longer match any flow's generation and are skipped by dispatch()
+    }
+
+    bool EgressScheduler::enqueue(Connection& conn, const char* buf, size_t len)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = flows.find(&conn);
+#ifdef LOGURU_SUPPORT
+        CHECK_S(it != flows.end()) << "Tried to enqueue data on a connection not registered with the scheduler.";
+#else
+        if (it == flows.end())
+        {
+            std::cerr << "Tried to enqueue data on a connection not registered with the scheduler." << std::endl;
+            exit(-1);
+        }
+#endif
+        Flow& flow = it->second;
+        if (flow.paused) return false;
+        if (0 == len) return true;
+
+        flow.queue.emplace_back(buf, buf + len);
+        flow.queued += len;
+        if (flow.queued >= high_watermark)
+            flow.paused = true;
+
+        if (!flow.active)
+        {
+            flow.active = true;
+            active_flows.emplace_back(&conn, flow.generation);
+            next_eligible = Clock::time_point();
+            work_cv.notify_all();
+        }
+
+        return true;
+    }
+
+    void EgressScheduler::refill(Flow& flow, Clock::time_point now)
+    {
+        if (0 == flow.rate) return;
+
+        std::chrono::duration<double> elapsed = now - flow.last_refill;
+        flow.tokens = std::min(flow.burst, flow.tokens + elapsed.count() * flow.rate);
+        flow.last_refill = now;
+    }
+
+    // how long a connection whose socket buffer was full waits before it is retried
+    static const std::chrono::milliseconds BLOCKED_RETRY_INTERVAL(1);
+
+    /*
+     * Earliest time a flow left with queued data can write again. A throttled flow waits until
+     * its bucket holds a round's worth of tokens, or all it has queued if that is less, rather
+     * than waking up for every byte refilled. Writability of a full socket is not tracked, such
+     * flows are simply retried a little later.
+     */
+    EgressScheduler::Clock::time_point EgressScheduler::eligibleAt(const Flow& flow, bool blocked,
+                                                                   Clock::time_point now) const
+    {
+        if (blocked) return now + BLOCKED_RETRY_INTERVAL;
+        if (0 == flow.rate) return now;
+
+        double wanted = std::min(std::min((double) flow.queued, (double) (quantum * flow.weight)), flow.burst);
+        if (flow.tokens >= wanted) return now;
+        return now + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>((wanted - flow.tokens) / (double) flow.rate));
+    }
+
+    size_t EgressScheduler::dispatch()
+    {
+        std::vector<Connection*> resumed;
+        size_t total_written = 0;
+
+        std::unique_lock<std::mutex> guard(lock);
+        auto now = Clock::now();
+
+        /*
+         * Writes never block: a connection whose socket buffer is full keeps the unsent
+         * remainder at the head of its queue and simply loses the rest of its turn, so
+         * a peer which stops reading cannot hold up the other connections.
+         */
+
+        // one round covers the flows active at its start, newly activated flows wait for the next one
+        auto eligible = Clock::time_point::max();
+        size_t round = active_flows.size();
+        for (size_t i = 0; i < round; ++i)
+        {
+            Connection* conn = active_flows.front().first;
+            uint64_t generation = active_flows.front().second;
+            active_flows.pop_front();
+
+            auto it = flows.find(conn);
+            if (it == flows.end() || it->second.generation != generation) continue;
+            Flow* flow = &it->second;
+
+            flow->deficit += quantum * flow->weight;
+            refill(*flow, now);
+
+            size_t allowance = flow->deficit;
+            if (flow->rate > 0)
+                allowance = std::min(allowance, (size_t) flow->tokens);
+
+            bool dropped = false;
+            bool blocked = false;
+            while (allowance > 0 && !flow->queue.empty())
+            {
+                // large buffers go out in chunks of at most the remaining allowance
+                std::vector<char>& head = flow->queue.front();
+                size_t chunk = std::min(allowance, head.size() - flow->head_offset);
+                ssize_t sent = conn->trySend(head.data() + flow->head_offset, chunk);
+
+                if (-1 == sent)
+                {
+                    // peer closed the connection
+                    flows.erase(conn);
+                    dropped = true;
+                    break;
+                }
+                if (0 == sent)
+                {
+                    // would block, retry on the next round
+                    blocked = true;
+                    break;
+                }
+
+                flow->head_offset += sent;
+                flow->queued -= sent;
+                flow->deficit -= sent;
+                allowance -= sent;
+                if (flow->rate > 0) flow->tokens -= sent;
+                total_written += sent;
+
+                if (flow->head_offset == head.size())
+                {
+                    flow->queue.pop_front();
+                    flow->head_offset = 0;
+                }
+
+                if (flow->paused && flow->queued <= low_watermark)
+                {
+                    flow->paused = false;
+                    resumed.push_back(conn);
+                }
+            }
+
+            if (dropped) continue;
+
+            if (flow->queue.empty())
+            {
+                flow->deficit = 0;
+                flow->active = false;
+            }
+            else
+            {
+                // only throttled or blocked flows keep credit, and never more than a single round's worth
+                flow->deficit = std::min(flow->deficit, quantum * flow->weight);
+                active_flows.emplace_back(conn, flow->generation);
+                eligible = std::min(eligible, eligibleAt(*flow, blocked, now));
+            }
+        }
+        next_eligible = eligible;
+        guard.unlock();
+
+        if (on_writable)
+            for (auto conn : resumed)
+                on_writable(*conn);
+
+        return total_written;
+    }
+
+    bool EgressScheduler::waitForWork(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;)
+        {
+            auto now = Clock::now();
+            if (!active_flows.empty() && next_eligible <= now) return true;
+            if (now >= deadline) return false;
+            work_cv.wait_until(guard, active_flows.empty() ? deadline : std::min(deadline, next_eligible));
+        }
+    }
+
+    bool EgressScheduler::isWritable(Connection& conn) const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = flows.find(&conn);
+        return it != flows.end() && !it->second.paused;
+    }
+
+    size_t EgressScheduler::pending(Connection& conn) const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = flows.find(&conn);
+        return it == flows.end() ? 0 : it->second.queued;
+    }
+
     TCPCommonSocket::TCPCommonSocket(uint16_t port) :
     socket_fd(socket(AF_INET, SOCK_STREAM, 0)), port(port)
     {
@@ -402,7 +1086,7 @@ namespace socketscpp
         int set_opt = 1;
         setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, (char*) &set_opt, sizeof(int));
 
-        auto _addr = new sockaddr_in{};
+        auto _addr = (sockaddr_in*) calloc(1, sizeof(sockaddr_in));
         _addr->sin_family = AF_INET;
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "OCDFAInspection"
@@ -416,13 +1100,24 @@ namespace socketscpp
 
         socketAPI.send = send;
         socketAPI.recv = recv;
+        socketAPI.close = close;
+        socketAPI.shutdown = shutdown;
+        socketAPI.poll = poll;
 
         socketAPI.error_code = -1;
     }
 
     TCPCommonSocket::~TCPCommonSocket()
     {
-        close(socket_fd);
+        if (-1 != socket_fd) close(socket_fd);
+    }
+
+    void TCPCommonSocket::setTimeouts(const ConnectionTimeouts& timeouts, std::shared_ptr<TimerWheel> wheel)
+    {
+        if (!wheel) wheel = std::make_shared<TimerWheel>();
+        wheel->start();
+        this->wheel = std::move(wheel);
+        this->timeouts = timeouts;
     }
 
     TCPServerSocket::TCPServerSocket(uint16_t port)
@@ -452,7 +1147,7 @@ namespace socketscpp
 
     Connection TCPServerSocket::AcceptConnection()
     {
-        auto* peer_addr = (sockaddr*) (new sockaddr_in{});
+        auto* peer_addr = (sockaddr*) calloc(1, sizeof(sockaddr_in));
         socklen_t len = sizeof(sockaddr_in);
         int connection_fd = socketAPI.accept(socket_fd, peer_addr, &len);
 #ifdef LOGURU_SUPPORT
@@ -462,7 +1157,7 @@ namespace socketscpp
         if (socketAPI.error_code == connection_fd) exit(errno);
 #endif
 
-        return Connection(connection_fd, peer_addr, socketAPI);
+        return Connection(connection_fd, peer_addr, socketAPI, wheel, timeouts);
     }
 
     Connection TCPServerSocket::Connect()
@@ -475,33 +1170,345 @@ namespace socketscpp
 #endif
     }
 
+    /*
+     * Host name resolution for client sockets. getaddrinfo() runs on a detached resolver thread so
+     * that the caller can give up at its connect deadline, and results are kept in a process wide
+     * cache so that reconnecting clients do not hit the resolver again.
+     * getaddrinfo() does not expose record TTLs, so cached entries live for a fixed, configurable time.
+     */
+    struct ResolvedAddress
+    {
+        sockaddr_storage addr;
+        socklen_t len;
+        int family;
+    };
+
+    struct DNSCacheEntry
+    {
+        std::vector<ResolvedAddress> addresses;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    struct DNSLookup
+    {
+        int rc;
+        std::vector<ResolvedAddress> addresses;
+    };
+
+    struct DNSState
+    {
+        std::mutex lock;
+        std::unordered_map<std::string, DNSCacheEntry> cache;
+        std::chrono::seconds ttl{30};
+
+        // lookups still running, shared by every caller resolving the same host:port
+        std::unordered_map<std::string, std::shared_future<DNSLookup>> inflight;
+    };
+
+    /*
+     * Resolver threads are detached and may outlive main(), so the state they update is
+     * allocated once and never destroyed rather than torn down with the other statics.
+     */
+    static DNSState& dnsState()
+    {
+        static auto* state = new DNSState();
+        return *state;
+    }
+
+    void TCPClientSocket::setDNSCacheTTL(std::chrono::seconds ttl)
+    {
+        DNSState& dns = dnsState();
+        std::lock_guard<std::mutex> guard(dns.lock);
+        dns.ttl = ttl;
+        if (0 == ttl.count()) dns.cache.clear();
+    }
+
+    void TCPClientSocket::flushDNSCache()
+    {
+        DNSState& dns = dnsState();
+        std::lock_guard<std::mutex> guard(dns.lock);
+        dns.cache.clear();
+    }
+
+    static int lookupAddresses(const std::string& host, const std::string& service, int flags,
+                               std::vector<ResolvedAddress>& out)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = flags;
+
+        addrinfo* res = nullptr;
+        int rc = getaddrinfo(host.c_str(), service.c_str(), &hints, &res);
+        if (0 != rc) return rc;
+
+        for (addrinfo* ai = res; nullptr != ai; ai = ai->ai_next)
+        {
+            if (AF_INET != ai->ai_family && AF_INET6 != ai->ai_family) continue;
+            ResolvedAddress r{};
+            memcpy(&r.addr, ai->ai_addr, ai->ai_addrlen);
+            r.len = ai->ai_addrlen;
+            r.family = ai->ai_family;
+            out.push_back(r);
+        }
+        freeaddrinfo(res);
+        return 0;
+    }
+
+    /*
+     * Resolves host:port before the deadline. Returns 0 on success, or a getaddrinfo() error
+     * code (EAI_AGAIN when the deadline expired first).
+     */
+    static int resolve(const std::string& host, uint16_t port,
+                       std::chrono::steady_clock::time_point deadline,
+                       std::vector<ResolvedAddress>& out)
+    {
+        std::string service = std::to_string(port);
+
+        // address literals need no resolver round trip, nor caching
+        if (0 == lookupAddresses(host, service, AI_NUMERICHOST, out)) return 0;
+
+        std::string key = host + ":" + service;
+        DNSState& dns = dnsState();
+        std::shared_future<DNSLookup> future;
+        {
+            std::lock_guard<std::mutex> guard(dns.lock);
+            auto it = dns.cache.find(key);
+            if (it != dns.cache.end())
+            {
+                if (std::chrono::steady_clock::now() < it->second.expiry)
+                {
+                    out = it->second.addresses;
+                    return 0;
+                }
+                dns.cache.erase(it);
+            }
+
+            /*
+             * Join a lookup already running for this key, so that a reconnect storm during
+             * a resolver outage does not spawn one resolver thread per Connect().
+             */
+            auto inflight = dns.inflight.find(key);
+            if (inflight != dns.inflight.end())
+                future = inflight->second;
+            else
+            {
+                auto promise = std::make_shared<std::promise<DNSLookup>>();
+                future = promise->get_future().share();
+                dns.inflight[key] = future;
+
+                std::thread([&dns, host, service, key, promise]()
+                            {
+                                DNSLookup lookup{};
+                                lookup.rc = lookupAddresses(host, service, AI_ADDRCONFIG, lookup.addresses);
+                                if (0 == lookup.rc && lookup.addresses.empty()) lookup.rc = EAI_NONAME;
+
+                                {
+                                    // cache from here, so that callers which gave up still benefit
+                                    std::lock_guard<std::mutex> guard(dns.lock);
+                                    if (0 == lookup.rc && dns.ttl.count() > 0)
+                                        dns.cache[key] = DNSCacheEntry{lookup.addresses,
+                                                                       std::chrono::steady_clock::now() +
+                                                                       dns.ttl};
+                                    dns.inflight.erase(key);
+                                }
+                                promise->set_value(std::move(lookup));
+                            }).detach();
+            }
+        }
+
+        if (std::future_status::ready != future.wait_until(deadline))
+            return EAI_AGAIN;
+
+        const DNSLookup& lookup = future.get();
+        if (0 != lookup.rc) return lookup.rc;
+
+        out = lookup.addresses;
+        return 0;
+    }
+
+    static void invalidateDNSCache(const std::string& host, uint16_t port)
+    {
+        DNSState& dns = dnsState();
+        std::lock_guard<std::mutex> guard(dns.lock);
+        dns.cache.erase(host + ":" + std::to_string(port));
+    }
+
+    /*
+     * Reorders resolved addresses so that families alternate, starting with the family of the
+     * first (most preferred) address, as described in RFC 8305 section 4.
+     */
+    static std::vector<ResolvedAddress> interleaveFamilies(const std::vector<ResolvedAddress>& addresses)
+    {
+        std::vector<ResolvedAddress> first, second, ordered;
+        for (auto& a : addresses)
+            (a.family == addresses.front().family ? first : second).push_back(a);
+
+        for (size_t i = 0; i < std::max(first.size(), second.size()); ++i)
+        {
+            if (i < first.size()) ordered.push_back(first[i]);
+            if (i < second.size()) ordered.push_back(second[i]);
+        }
+        return ordered;
+    }
+
     TCPClientSocket::TCPClientSocket(std::string address, uint16_t port)
-    : TCPCommonSocket(port), address(std::move(address))
+    : TCPCommonSocket(port), address(std::move(address)),
+      connect_timeout(10000), attempt_delay(250)
     {
+        /*
+         * Every Connect() opens its own sockets for the families it races, and each resulting
+         * connection owns its descriptor, so the IPv4 socket opened by TCPCommonSocket is not needed.
+         */
+        close(socket_fd);
+        socket_fd = -1;
+
         auto _addr = (sockaddr_in*) ISocket::getAddr();
-        _addr->sin_addr.s_addr = inet_addr(this->address.c_str());
         _addr->sin_port = htons(port);
     }
 
     Connection TCPClientSocket::Connect()
     {
+        using Clock = std::chrono::steady_clock;
+        auto deadline = Clock::now() + connect_timeout;
+
+        std::vector<ResolvedAddress> resolved;
+        int rc = resolve(address, port, deadline, resolved);
+#ifdef LOGURU_SUPPORT
+        CHECK_EQ_S(rc, 0) << "Could not resolve host " << address << ": " << gai_strerror(rc);
+#else
+        if (0 != rc)
+        {
+            std::cerr << "Could not resolve host " << address << ": " << gai_strerror(rc) << std::endl;
+            exit(EAI_AGAIN == rc ? ETIMEDOUT : EHOSTUNREACH);
+        }
+#endif
+        std::vector<ResolvedAddress> candidates = interleaveFamilies(resolved);
+
+        /*
+         * Happy eyeballs: start a non-blocking connection attempt to the next candidate whenever
+         * the attempt delay elapses or an earlier attempt fails, and keep the first one to complete.
+         */
+        std::vector<pollfd> attempts;
+        std::vector<size_t> attempt_index;
+        size_t next = 0;
+        auto next_attempt = Clock::now();
+        int winner_fd = -1;
+        size_t winner = 0;
+        int last_error = ETIMEDOUT;
+
+        while (-1 == winner_fd)
+        {
+            auto now = Clock::now();
+            if (now >= deadline)
+            {
+                last_error = ETIMEDOUT;
+                break;
+            }
+
+            if (next < candidates.size() && (now >= next_attempt || attempts.empty()))
+            {
+                const ResolvedAddress& candidate = candidates[next];
+                int fd = socket(candidate.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (-1 == fd)
+                {
+                    last_error = errno;
+                    ++next;
+                    continue;
+                }
+
+                if (socketAPI.error_code != socketAPI.connect(fd, (const sockaddr*) &candidate.addr, candidate.len))
+                {
+                    winner_fd = fd;
+                    winner = next;
+                    break;
+                }
+                if (EINPROGRESS != errno)
+                {
+                    last_error = errno;
+                    close(fd);
+                    ++next;
+                    continue;
+                }
+
+                attempts.push_back(pollfd{fd, POLLOUT, 0});
+                attempt_index.push_back(next++);
+                next_attempt = now + attempt_delay;
+                continue;
+            }
+
+            if (attempts.empty()) break; // every candidate failed
+
+            auto wake = (next < candidates.size()) ? std::min(deadline, next_attempt) : deadline;
+            auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1;
+            if (-1 == poll(attempts.data(), attempts.size(), (int) timeout))
+            {
+                if (EINTR == errno) continue;
+                last_error = errno;
+                break;
+            }
+
+            for (size_t i = 0; i < attempts.size();)
+            {
+                if (0 == attempts[i].revents)
+                {
+                    ++i;
+                    continue;
+                }
+
+                int so_error = 0;
+                socklen_t so_len = sizeof(so_error);
+                getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &so_len);
+                if (0 == so_error && -1 == winner_fd)
+                {
+                    winner_fd = attempts[i].fd;
+                    winner = attempt_index[i];
+                }
+                else
+                {
+                    // failed attempt, move on to the next candidate right away
+                    if (0 != so_error) last_error = so_error;
+                    close(attempts[i].fd);
+                    next_attempt = now;
+                }
+                attempts.erase(attempts.begin() + i);
+                attempt_index.erase(attempt_index.begin() + i);
+            }
+        }
+
+        // abandon the attempts that lost the race
+        for (auto& attempt : attempts)
+            close(attempt.fd);
+
+        if (-1 == winner_fd)
+        {
+            // the cached addresses may be stale after a failover, re-resolve on the next try
+            invalidateDNSCache(address, port);
+            errno = last_error;
+        }
 #ifdef LOGURU_SUPPORT
-        CHECK_NE_S(socketAPI.connect(socket_fd, ISocket::getAddr(), sizeof(sockaddr_in)), socketAPI.error_code)
+        CHECK_NE_S(winner_fd, -1)
         << "Could not connect to host " << address << ":" << port << ", errno: " << strerror(errno);
 #else
-        if (socketAPI.error_code == socketAPI.connect(socket_fd, ISocket::getAddr(), sizeof(sockaddr_in))) exit(errno);
+        if (-1 == winner_fd) exit(errno);
 #endif
 
+        // the connection itself uses blocking I/O
+        fcntl(winner_fd, F_SETFL, fcntl(winner_fd, F_GETFL) & ~O_NONBLOCK);
+
+        auto peer_addr = (sockaddr*) calloc(1, sizeof(sockaddr_storage));
+        memcpy(peer_addr, &candidates[winner].addr, candidates[winner].len);
+        ISocket::setAddr(peer_addr);
+
         /*
          * We need to copy the socket address to a new structure to pass to the connection since the destructor
-         * of the connection deletes its address - and we don't want to end up with a dangling pointer here,
+         * of the connection frees its address - and we don't want to end up with a dangling pointer here,
          * do we now?
          */
-        auto _addr = ISocket::getAddr();
-        auto n_addr = (sockaddr*) malloc(sizeof(sockaddr));
-        memcpy(n_addr, _addr, sizeof(sockaddr));
+        auto n_addr = (sockaddr*) calloc(1, sizeof(sockaddr_storage));
+        memcpy(n_addr, peer_addr, candidates[winner].len);
 
-        return Connection(socket_fd, n_addr, socketAPI);
+        return Connection(winner_fd, n_addr, socketAPI);
     }
 
     void TCPClientSocket::BindAndListen()
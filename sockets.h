@@ -9,6 +9,7 @@
 #define MIGRATIONORCHESTRATOR_SOCKETS_H
 
 #include <glob.h>
+#include <cstdlib>
 #include <string>
 
 #ifdef PROTOBUF_SUPPORT
@@ -17,7 +18,18 @@
 
 #include <functional>
 #include <utility>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <sys/socket.h>
+#include <poll.h>
+
+#include "serialization.h"
 
 #define MAX_CONNECTION_BACKLOG 128
 
@@ -38,8 +50,105 @@ namespace socketscpp
 
         std::function<ssize_t(int, const void*, size_t, int)> send;
         std::function<ssize_t(int, void*, size_t, int)> recv;
+        std::function<int(int)> close;
+        std::function<int(int, int)> shutdown;
+        std::function<int(pollfd*, nfds_t, int)> poll;
     };
 
+/**
+ * @brief Hierarchical timing wheel used to drive connection timeouts.
+ *
+ * Timers are intrusive list nodes, so arming and cancelling one is O(1). Expired timers
+ * are fired by a single driver thread per wheel ticking at a fixed resolution, instead
+ * of one timer syscall per connection. Callbacks run on the driver thread with the wheel
+ * locked: they may re-arm timers, and once cancel() returns the timer's callback is
+ * guaranteed not to be running.
+ */
+    class TimerWheel
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        struct Timer
+        {
+            std::function<void()> callback;
+
+        private:
+            friend class TimerWheel;
+
+            uint64_t expiry = 0;
+            Timer* prev = nullptr;
+            Timer* next = nullptr;
+            Timer** slot = nullptr; // list this timer is linked into, null when not armed
+        };
+
+    private:
+        static const unsigned LEVEL_BITS = 6;
+        static const unsigned LEVELS = 4;
+        static const uint64_t SLOTS = 1u << LEVEL_BITS;
+
+        const Clock::duration tick;
+        const Clock::time_point origin;
+        uint64_t current;
+        Timer* slots[LEVELS][SLOTS];
+
+        mutable std::recursive_mutex lock;
+
+        std::thread driver;
+        std::mutex driver_lock;
+        std::condition_variable driver_cv;
+        bool running;
+
+        void link(Timer& timer);
+        void unlink(Timer& timer);
+        void cascade(unsigned level);
+
+    public:
+        /**
+         * @param tick Resolution of the wheel. Four levels of 64 slots cover 2^24 ticks,
+         * longer delays are clamped.
+         */
+        explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(100));
+        ~TimerWheel();
+
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+
+        /**
+         * @brief Arms the timer to fire after the given delay, re-arming it if already armed.
+         */
+        void schedule(Timer& timer, std::chrono::milliseconds delay);
+        void cancel(Timer& timer);
+        bool isArmed(const Timer& timer) const;
+
+        /**
+         * @brief Fires every timer due up to the given time point.
+         * @return Number of timers fired.
+         */
+        size_t advance(Clock::time_point now);
+
+        /**
+         * @brief Starts the driver thread which advances the wheel once per tick.
+         */
+        void start();
+        void stop();
+    };
+
+/**
+ * @brief Per-connection timeouts enforced through a TimerWheel. Zero disables a timeout.
+ * A connection hitting its idle timeout or a read/write deadline is shut down, which wakes
+ * up any call blocked on it; the owner then sees the peer as closed and releases the connection.
+ */
+    struct ConnectionTimeouts
+    {
+        std::chrono::milliseconds idle{0};      // time without any traffic before the connection is reaped
+        std::chrono::milliseconds read{0};      // deadline for each receive call
+        std::chrono::milliseconds write{0};     // deadline for each send call
+        std::chrono::milliseconds heartbeat{0}; // interval at which heartbeatDue() is raised
+    };
+
+    struct ConnectionTimers;
+
 /**
  * @brief Represents one end of a connection on top of a socket,
  * and provides helper methods to send data to and receive data
@@ -53,15 +162,22 @@ namespace socketscpp
         bool open;
 
         SocketAPI socketAPI;
+        std::shared_ptr<ConnectionTimers> timers;
 
     public:
         Connection() : open(false), fd(-1), addr(nullptr)
         {}
 
+        /**
+         * @param addr Peer address, allocated with malloc()/calloc(); the connection takes ownership.
+         */
         Connection(const int fd, sockaddr* addr, SocketAPI api)
         : fd(fd), addr(addr), socketAPI(std::move(api)), open(true)
         {}
 
+        Connection(int fd, sockaddr* addr, SocketAPI api,
+                   std::shared_ptr<TimerWheel> wheel, const ConnectionTimeouts& timeouts);
+
         ~Connection();
 
         template<typename Prim_Type>
@@ -72,9 +188,49 @@ namespace socketscpp
 
         size_t sendBuffer(char* buf, size_t len);
         size_t recvBuffer(char* buf, size_t len);
+
+        /**
+         * @brief Sends as much of the buffer as the socket accepts without blocking.
+         * @return Number of bytes sent, 0 if the socket buffer is full, or -1 if the connection is closed.
+         */
+        ssize_t trySend(const char* buf, size_t len);
         void Close();
         bool isOpen();
 
+        /**
+         * @brief Enforces the given timeouts on this connection, using the given wheel.
+         */
+        void setTimeouts(std::shared_ptr<TimerWheel> wheel, const ConnectionTimeouts& timeouts);
+
+        /**
+         * @return True if the connection was shut down by its idle timeout or a deadline.
+         */
+        bool isExpired() const;
+
+        /**
+         * @return True, once, every time the heartbeat interval elapses. Applications poll this
+         * from the thread owning the connection to send their heartbeat messages.
+         */
+        bool heartbeatDue();
+
+        /**
+         * @brief Sends a struct described with SOCKETSCPP_FIELDS in a single buffered write.
+         * Structs made up only of fixed-size fields are encoded into a stack buffer whose layout
+         * is computed at compile time; others are sent with a uint32_t length prefix.
+         * @return Number of bytes sent, 0 if the connection is closed or the encoded message
+         * is larger than MAX_STRUCT_MESSAGE_SIZE, in which case nothing is sent.
+         */
+        template<typename T>
+        size_t sendStruct(const T& msg);
+
+        /**
+         * @brief Receives a struct sent with sendStruct().
+         * @return Number of bytes received, 0 if the connection is closed or the message was
+         * malformed, in which case the connection is closed as well.
+         */
+        template<typename T>
+        size_t recvStruct(T& msg);
+
 #ifdef PROTOBUF_SUPPORT
         /**
          * @brief Sends a protobuf message through the connection.
@@ -98,6 +254,172 @@ namespace socketscpp
         { socketAPI = std::move(api); }
     };
 
+    template<typename T>
+    size_t Connection::sendStruct(const T& msg)
+    {
+        using Codec = wire::Codec<T>;
+
+        if (Codec::fixed)
+        {
+            wire::Buffer<Codec::fixed ? Codec::size : 0> buf;
+            Codec::encode(msg, buf.data());
+            return sendBuffer(buf.data(), Codec::size);
+        }
+
+        size_t len = Codec::encodedSize(msg);
+        if (len > MAX_STRUCT_MESSAGE_SIZE) return 0; // the peer would reject it
+
+        std::vector<char> buf(wire::Length::size + len);
+        Codec::encode(msg, wire::Length::encode((uint32_t) len, buf.data()));
+        return sendBuffer(buf.data(), buf.size());
+    }
+
+    template<typename T>
+    size_t Connection::recvStruct(T& msg)
+    {
+        using Codec = wire::Codec<T>;
+
+        if (Codec::fixed)
+        {
+            wire::Buffer<Codec::fixed ? Codec::size : 0> buf;
+            if (Codec::size != recvBuffer(buf.data(), Codec::size)) return 0;
+            Codec::decode(msg, buf.data(), buf.data() + Codec::size);
+            return Codec::size;
+        }
+
+        char header[wire::Length::size];
+        uint32_t len = 0;
+        if (wire::Length::size != recvBuffer(header, wire::Length::size)) return 0;
+        wire::Length::decode(len, header, header + wire::Length::size);
+        if (len > MAX_STRUCT_MESSAGE_SIZE)
+        {
+            Close();
+            return 0;
+        }
+
+        std::vector<char> buf(len);
+        if (len != recvBuffer(buf.data(), len)) return 0;
+        if (buf.data() + len != Codec::decode(msg, buf.data(), buf.data() + len))
+        {
+            // the stream is out of sync with the peer, nothing sensible can follow
+            Close();
+            return 0;
+        }
+        return wire::Length::size + len;
+    }
+
+/**
+ * @brief Egress scheduler sitting in front of the writes of many Connections.
+ *
+ * Outgoing data is queued per connection and written out in deficit round robin
+ * order, so that a connection streaming large buffers cannot starve the rest:
+ * on every round each connection may write at most quantum * weight bytes,
+ * optionally further limited by a per-connection token bucket.
+ * Queued bytes are tracked against high/low watermarks to provide backpressure.
+ *
+ * Writes are non-blocking, so a connection whose peer stops reading only holds up its own queue.
+ * All methods may be called from any thread; dispatch() is meant to be driven by a single
+ * writer thread, and returns 0 when every queued connection is throttled or would block.
+ */
+    class EgressScheduler
+    {
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Flow
+        {
+            Connection* conn = nullptr;
+            uint64_t generation; // tells a re-registered connection apart from a removed one
+            uint32_t weight;
+
+            // token bucket, rate == 0 means unlimited
+            uint64_t rate;
+            double burst;
+            double tokens;
+            Clock::time_point last_refill;
+
+            size_t deficit;
+            size_t queued;
+            size_t head_offset;
+            std::deque<std::vector<char>> queue;
+
+            bool active;
+            bool paused;
+        };
+
+        const size_t quantum;
+        const size_t high_watermark;
+        const size_t low_watermark;
+
+        mutable std::mutex lock;
+        std::condition_variable work_cv;
+        std::unordered_map<Connection*, Flow> flows;
+        std::deque<std::pair<Connection*, uint64_t>> active_flows;
+        uint64_t next_generation = 0;
+        Clock::time_point next_eligible; // earliest time the next round can write anything
+
+        std::function<void(Connection&)> on_writable;
+
+        void refill(Flow& flow, Clock::time_point now);
+        Clock::time_point eligibleAt(const Flow& flow, bool blocked, Clock::time_point now) const;
+
+    public:
+        /**
+         * @param quantum Bytes credited to a connection of weight 1 on each round.
+         * @param high_watermark Queued bytes above which a connection stops accepting data.
+         * @param low_watermark Queued bytes below which a paused connection becomes writable again.
+         */
+        explicit EgressScheduler(size_t quantum = 16384,
+                                 size_t high_watermark = 4194304,
+                                 size_t low_watermark = 1048576);
+
+        /**
+         * @brief Registers a connection with the scheduler.
+         * @param conn The connection, which must outlive its registration.
+         * @param weight Relative share of the bandwidth for this connection.
+         * @param rate Maximum sustained rate in bytes per second, 0 for unlimited.
+         * @param burst Token bucket depth in bytes, defaults to one second worth of rate.
+         */
+        void addConnection(Connection& conn, uint32_t weight = 1, uint64_t rate = 0, uint64_t burst = 0);
+
+        /**
+         * @brief Unregisters a connection, discarding any data still queued for it.
+         */
+        void removeConnection(Connection& conn);
+
+        /**
+         * @brief Queues a buffer for sending on a registered connection.
+         * @return False if the connection is over its high watermark, in which case
+         * nothing is queued and the caller should wait until it is writable again.
+         */
+        bool enqueue(Connection& conn, const char* buf, size_t len);
+
+        /**
+         * @brief Runs one deficit round robin round over all connections with queued data.
+         * Call waitForWork() between rounds rather than calling this in a loop.
+         * @return Total number of bytes written.
+         */
+        size_t dispatch();
+
+        /**
+         * @brief Blocks until the next dispatch() round may be able to write: data was
+         * enqueued, a rate limited connection has refilled its tokens, or a connection
+         * whose socket buffer was full is due to be retried.
+         * @return False if the deadline passed first.
+         */
+        bool waitForWork(std::chrono::steady_clock::time_point deadline);
+
+        bool isWritable(Connection& conn) const;
+        size_t pending(Connection& conn) const;
+
+        /**
+         * @brief Sets a callback invoked from dispatch() when a paused connection
+         * drains below the low watermark.
+         */
+        void setWritableCallback(std::function<void(Connection&)> callback)
+        { on_writable = std::move(callback); }
+    };
+
 /**
  * @brief Base class for all sockets. Defines a common interface for all sockets,
  * unix, tcp, udp or udt to adhere to.
@@ -114,10 +436,11 @@ namespace socketscpp
         {}
 
         virtual ~ISocket()
-        { delete addr; }
+        { free(addr); }
 
         void setAddr(sockaddr* addr)
         {
+            free(this->addr);
             this->addr = addr;
         }
 
@@ -169,11 +492,26 @@ namespace socketscpp
         int socket_fd;
         const std::string socket_path;
         SocketAPI socketAPI;
+        ConnectionTimeouts timeouts;
+        std::shared_ptr<TimerWheel> wheel;
     public:
 
         explicit UnixSocket(std::string path);
         ~UnixSocket() override;
 
+        /**
+         * @brief Overrides the socket operations used by this socket and the
+         * connections it creates, for testing and dependency injection purposes.
+         */
+        void setSocketAPI(SocketAPI api)
+        { socketAPI = std::move(api); }
+
+        /**
+         * @brief Sets the timeouts enforced on connections created from now on.
+         * @param wheel Timer wheel to use, shared with other sockets. If null, the socket creates its own.
+         */
+        void setTimeouts(const ConnectionTimeouts& timeouts, std::shared_ptr<TimerWheel> wheel = nullptr);
+
         Connection Connect() override;
         void BindAndListen() override;
         Connection AcceptConnection() override;
@@ -185,10 +523,25 @@ namespace socketscpp
         int socket_fd;
         SocketAPI socketAPI;
         uint16_t port;
+        ConnectionTimeouts timeouts;
+        std::shared_ptr<TimerWheel> wheel;
 
     protected:
         explicit TCPCommonSocket(uint16_t port);
         ~TCPCommonSocket() override;
+
+        /**
+         * @brief Overrides the socket operations used by this socket and the
+         * connections it creates, for testing and dependency injection purposes.
+         */
+        void setSocketAPI(SocketAPI api)
+        { socketAPI = std::move(api); }
+
+        /**
+         * @brief Sets the timeouts enforced on connections accepted from now on.
+         * @param wheel Timer wheel to use, shared with other sockets. If null, the socket creates its own.
+         */
+        void setTimeouts(const ConnectionTimeouts& timeouts, std::shared_ptr<TimerWheel> wheel = nullptr);
     };
 
     class TCPServerSocket : protected TCPCommonSocket
@@ -198,6 +551,9 @@ namespace socketscpp
         explicit TCPServerSocket(uint16_t port);
         ~TCPServerSocket() override = default;
 
+        using TCPCommonSocket::setSocketAPI;
+        using TCPCommonSocket::setTimeouts;
+
         void BindAndListen() override;
         Connection AcceptConnection() override;
 
@@ -209,11 +565,43 @@ namespace socketscpp
     {
     protected:
         std::string address;
+        std::chrono::milliseconds connect_timeout;
+        std::chrono::milliseconds attempt_delay;
 
     public:
+        /**
+         * @param address Host name, or IPv4/IPv6 address literal, of the server.
+         * @param port Port of the server.
+         */
         TCPClientSocket(std::string address, uint16_t port);
         ~TCPClientSocket() override = default;
 
+        using TCPCommonSocket::setSocketAPI;
+
+        /**
+         * @brief Sets the deadline for a whole Connect() call, name resolution included.
+         */
+        void setConnectTimeout(std::chrono::milliseconds timeout)
+        { connect_timeout = timeout; }
+
+        /**
+         * @brief Sets the delay before racing a connection attempt to the next resolved
+         * address while earlier attempts are still pending (RFC 8305 Connection Attempt Delay).
+         */
+        void setAttemptDelay(std::chrono::milliseconds delay)
+        { attempt_delay = delay; }
+
+        /**
+         * @brief Sets for how long resolved host names are cached, process wide.
+         * A zero TTL disables the cache.
+         */
+        static void setDNSCacheTTL(std::chrono::seconds ttl);
+
+        /**
+         * @brief Drops all cached host name resolutions.
+         */
+        static void flushDNSCache();
+
         Connection Connect() override;
 
     private: